@@ -21,42 +21,317 @@
 
 #include "MiniHeap.h"
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 namespace spades {
+	namespace {
+		/** Returns the index of the most significant set bit. `v` must be non-zero. */
+		inline int FindLastSet(std::uint64_t v) {
+#ifdef _MSC_VER
+			unsigned long idx;
+#ifdef _WIN64
+			_BitScanReverse64(&idx, v);
+#else
+			if (v >> 32) {
+				_BitScanReverse(&idx, static_cast<unsigned long>(v >> 32));
+				idx += 32;
+			} else {
+				_BitScanReverse(&idx, static_cast<unsigned long>(v));
+			}
+#endif
+			return static_cast<int>(idx);
+#else
+			return 63 - __builtin_clzll(v);
+#endif
+		}
+
+		/** Returns the index of the least significant set bit. `v` must be non-zero. */
+		inline int FindFirstSet(std::uint64_t v) {
+#ifdef _MSC_VER
+			unsigned long idx;
+#ifdef _WIN64
+			_BitScanForward64(&idx, v);
+#else
+			if (static_cast<std::uint32_t>(v)) {
+				_BitScanForward(&idx, static_cast<unsigned long>(v));
+			} else {
+				_BitScanForward(&idx, static_cast<unsigned long>(v >> 32));
+				idx += 32;
+			}
+#endif
+			return static_cast<int>(idx);
+#else
+			return __builtin_ctzll(v);
+#endif
+		}
+	} // namespace
+
+	MiniHeap::MiniHeap(size_t initialSize)
+	    : firstLevelBitmap(0) {
+		secondLevelBitmap.fill(0);
+		for (auto& lists : freeLists)
+			lists.fill(NoFreeRegion);
+
+		if (initialSize < 16)
+			initialSize = 16;
+		buffer.resize(initialSize);
+
+		AddFreeRegion(0, initialSize);
+		SPAssert(Validate());
+	}
+
+	void MiniHeap::MapSize(size_t bytes, int& fl, int& sl) {
+		SPAssert(bytes > 0);
+		if (bytes < SecondLevelCount) {
+			fl = 0;
+			sl = static_cast<int>(bytes);
+		} else {
+			int msb = FindLastSet(bytes);
+			fl = msb - SecondLevelLog2 + 1;
+			sl = static_cast<int>(bytes >> (msb - SecondLevelLog2)) - SecondLevelCount;
+		}
+	}
+
+	size_t MiniHeap::FindFreeRegion(size_t bytes) {
+		// round up to the next size class so that any region in the found
+		// list is large enough
+		if (bytes >= SecondLevelCount) {
+			size_t round = (size_t(1) << (FindLastSet(bytes) - SecondLevelLog2)) - 1;
+			if (bytes + round < bytes)
+				return NoFreeRegion;
+			bytes += round;
+		}
+
+		int fl, sl;
+		MapSize(bytes, fl, sl);
+
+		std::uint32_t slMap = secondLevelBitmap[fl] & (~0U << sl);
+		if (!slMap) {
+			if (fl + 1 >= FirstLevelCount)
+				return NoFreeRegion;
+			std::uint64_t flMap = firstLevelBitmap & (~std::uint64_t(0) << (fl + 1));
+			if (!flMap)
+				return NoFreeRegion;
+			fl = FindFirstSet(flMap);
+			slMap = secondLevelBitmap[fl];
+			SPAssert(slMap);
+		}
+		sl = FindFirstSet(slMap);
+
+		size_t index = freeLists[fl][sl];
+		SPAssert(index != NoFreeRegion);
+		return index;
+	}
+
+	size_t MiniHeap::AddFreeRegion(Ref start, Ref len) {
+		size_t index;
+		if (unusedRegions.empty()) {
+			index = regions.size();
+			regions.emplace_back();
+		} else {
+			index = unusedRegions.back();
+			unusedRegions.pop_back();
+		}
+
+		auto& r = regions[index];
+		r.start = start;
+		r.len = len;
+		regionByStart[start] = index;
+		regionByEnd[start + len] = index;
+		LinkFreeRegion(index);
+		return index;
+	}
+
+	void MiniHeap::LinkFreeRegion(size_t index) {
+		auto& r = regions[index];
+		int fl, sl;
+		MapSize(r.len, fl, sl);
+
+		size_t& head = freeLists[fl][sl];
+		r.prev = NoFreeRegion;
+		r.next = head;
+		if (head != NoFreeRegion)
+			regions[head].prev = index;
+		head = index;
+
+		firstLevelBitmap |= std::uint64_t(1) << fl;
+		secondLevelBitmap[fl] |= 1U << sl;
+	}
+
+	void MiniHeap::UnlinkFreeRegion(size_t index) {
+		auto& r = regions[index];
+		int fl, sl;
+		MapSize(r.len, fl, sl);
+
+		if (r.prev == NoFreeRegion) {
+			SPAssert(freeLists[fl][sl] == index);
+			freeLists[fl][sl] = r.next;
+			if (r.next == NoFreeRegion) {
+				secondLevelBitmap[fl] &= ~(1U << sl);
+				if (!secondLevelBitmap[fl])
+					firstLevelBitmap &= ~(std::uint64_t(1) << fl);
+			}
+		} else {
+			regions[r.prev].next = r.next;
+		}
+		if (r.next != NoFreeRegion)
+			regions[r.next].prev = r.prev;
+
+		r.prev = NoFreeRegion;
+		r.next = NoFreeRegion;
+	}
+
+	void MiniHeap::DeleteFreeRegion(size_t index) {
+		UnlinkFreeRegion(index);
+
+		auto& r = regions[index];
+		regionByStart.erase(r.start);
+		regionByEnd.erase(r.GetEnd());
+		r.start = 0xdeadbeef;
+		r.len = 0xdeadbeef;
+		unusedRegions.push_back(index);
+	}
+
+	void MiniHeap::Reserve(size_t bytes) {
+		size_t newSize = buffer.size();
+		while (newSize < bytes)
+			newSize <<= 1;
+		if (newSize == buffer.size())
+			return;
+		size_t oldSize = buffer.size();
+		buffer.resize(newSize);
+
+		// extend the free region at the end of the buffer, if any
+		auto it = regionByEnd.find(oldSize);
+		if (it != regionByEnd.end()) {
+			size_t index = it->second;
+			auto& r = regions[index];
+			UnlinkFreeRegion(index);
+			regionByEnd.erase(it);
+			r.len = newSize - r.start;
+			regionByEnd[newSize] = index;
+			LinkFreeRegion(index);
+		} else {
+			AddFreeRegion(oldSize, newSize - oldSize);
+		}
+		SPAssert(Validate());
+	}
+
+	MiniHeap::Ref MiniHeap::Alloc(size_t bytes) {
+		if (bytes == 0)
+			return 0;
+
+		size_t index = FindFreeRegion(bytes);
+		while (index == NoFreeRegion) {
+			Reserve(buffer.size() + bytes);
+			index = FindFreeRegion(bytes);
+		}
+
+		auto& f = regions[index];
+		SPAssert(f.len >= bytes);
+		Ref pos = f.start;
+		if (f.len == bytes) {
+			// free region is removed
+			DeleteFreeRegion(index);
+		} else {
+			UnlinkFreeRegion(index);
+			regionByStart.erase(f.start);
+			f.start += bytes;
+			f.len -= bytes;
+			regionByStart[f.start] = index;
+			LinkFreeRegion(index);
+		}
+		SPAssert(pos + bytes <= buffer.size());
+		SPAssert(Validate());
+		return pos;
+	}
+
+	void MiniHeap::Free(Ref offset, Ref len) {
+		if (len == 0)
+			return;
+		if (offset + len > buffer.size() || offset + len < offset)
+			SPRaise("Internal inconsistency detected: freeing out of bounds");
+		if (regionByStart.find(offset) != regionByStart.end())
+			SPRaise("Internal inconsistency detected: double free");
+
+		Ref start = offset;
+		Ref end = offset + len;
+
+		// recombine with the preceding free region?
+		auto it = regionByEnd.find(start);
+		if (it != regionByEnd.end()) {
+			size_t prev = it->second;
+			start = regions[prev].start;
+			DeleteFreeRegion(prev);
+		}
+
+		// recombine with the following free region?
+		it = regionByStart.find(end);
+		if (it != regionByStart.end()) {
+			size_t next = it->second;
+			end = regions[next].GetEnd();
+			DeleteFreeRegion(next);
+		}
+
+		AddFreeRegion(start, end - start);
+		SPAssert(Validate());
+	}
+
 	bool MiniHeap::Validate() {
-		Ref fl = firstFreeRegion;
-		Ref minPos = 0;
-		int count = 1000000;
-		Ref lst = NoFreeRegion;
-		while (fl != NoFreeRegion) {
-			if (fl > buffer.size())
-				SPRaise("Inconsistency detected: broken link");
-			if ((--count) < 1)
-				SPRaise("Inconsistency detected: looped linked list");
-			auto* f = Dereference<FreeRegion>(fl);
-			if (f->start < minPos) {
-				if (f->start == minPos - 1)
-					SPRaise("Inconsistency detected: uncombined");
-				SPRaise("Inconsistency detected: unsorted list");
+		size_t count = 0;
+		for (int fl = 0; fl < FirstLevelCount; fl++) {
+			if (static_cast<bool>((firstLevelBitmap >> fl) & 1) !=
+			    (secondLevelBitmap[fl] != 0))
+				SPRaise("Inconsistency detected: first level bitmap");
+
+			for (int sl = 0; sl < SecondLevelCount; sl++) {
+				size_t index = freeLists[fl][sl];
+				if (static_cast<bool>((secondLevelBitmap[fl] >> sl) & 1) !=
+				    (index != NoFreeRegion))
+					SPRaise("Inconsistency detected: second level bitmap");
+
+				size_t last = NoFreeRegion;
+				while (index != NoFreeRegion) {
+					if (index >= regions.size())
+						SPRaise("Inconsistency detected: broken link");
+					if ((++count) > regions.size())
+						SPRaise("Inconsistency detected: looped linked list");
+
+					const auto& f = regions[index];
+					if (f.start == 0xdeadbeef || f.len == 0xdeadbeef)
+						SPRaise("Inconsistency detected: not initialized");
+					if (f.len == 0)
+						SPRaise("Inconsistency detected: empty region");
+					if (f.GetEnd() > buffer.size())
+						SPRaise("Inconsistency detected: overflow");
+					if (f.prev != last)
+						SPRaise("Inconsistency detected: singly linked");
+
+					int rfl, rsl;
+					MapSize(f.len, rfl, rsl);
+					if (rfl != fl || rsl != sl)
+						SPRaise("Inconsistency detected: wrong size class");
+
+					auto it = regionByStart.find(f.start);
+					if (it == regionByStart.end() || it->second != index)
+						SPRaise("Inconsistency detected: start index");
+					it = regionByEnd.find(f.GetEnd());
+					if (it == regionByEnd.end() || it->second != index)
+						SPRaise("Inconsistency detected: end index");
+					if (regionByEnd.find(f.start) != regionByEnd.end())
+						SPRaise("Inconsistency detected: uncombined");
+
+					last = index;
+					index = f.next;
+				}
 			}
-			if (f->start == 0xDEADBEEF)
-				SPRaise("Inconsistency detected: not initialized (1)");
-			if (f->len == 0xDEADBEEF)
-				SPRaise("Inconsistency detected: not initialized (1)");
-			if (f->next == 0xDEADBEEF)
-				SPRaise("Inconsistency detected: not initialized (1)");
-			if (f->prev == 0xDEADBEEF)
-				SPRaise("Inconsistency detected: not initialized (1)");
-			if (f->GetEnd() > buffer.size())
-				SPRaise("Inconsistency detected: overflow");
-			minPos = f->GetEnd() + 1; // detect uncombineds
-
-			if (f->next == fl)
-				SPRaise("Inconsistency detected: self link");
-			if (f->prev != lst)
-				SPRaise("Inconsistency detected: singly linked");
-			lst = fl;
-			fl = f->next;
 		}
+
+		if (count != regionByStart.size() || count != regionByEnd.size() ||
+		    count + unusedRegions.size() != regions.size())
+			SPRaise("Inconsistency detected: leaked region");
 		return true;
 	}
-} // namespace spades
\ No newline at end of file
+} // namespace spades
@@ -120,22 +120,47 @@ namespace spades {
 			sw.Reset();
 			SPLog("Building RLE map...");
 
+			// Columns are independent, so each thread encodes a band of rows into
+			// its own buffer. Heap allocation is done afterwards on this thread
+			// because `MiniHeap` is not thread-safe.
+			std::array<std::vector<RleData>, 32> bandBufs;
+			unsigned int numBands = 1;
+
+			InvokeParallel2([&](unsigned int th, unsigned int numThreads) {
+				if (th == 0)
+					numBands = numThreads;
+
+				int startY = static_cast<int>(th * h / numThreads);
+				int endY = static_cast<int>((th + 1) * h / numThreads);
+				std::vector<RleData> buf;
+				auto& band = bandBufs[th];
+
+				for (int y = startY; y < endY; y++)
+				for (int x = 0; x < w; x++) {
+					BuildRle(x, y, buf);
+					band.insert(band.end(), buf.begin(), buf.end());
+					rleLen[x + y * w] = buf.size() * sizeof(RleData);
+				}
+			});
+
 			int idx = 0;
-			for (int y = 0; y < h; y++)
-			for (int x = 0; x < w; x++) {
-				BuildRle(x, y, rleBuf);
+			for (unsigned int th = 0; th < numBands; th++) {
+				int endY = static_cast<int>((th + 1) * h / numBands);
+				const RleData* src = bandBufs[th].data();
 
-				auto ref = rleHeap.Alloc(rleBuf.size() * sizeof(RleData));
-				short* ptr = rleHeap.Dereference<short>(ref);
-				std::memcpy(ptr, rleBuf.data(), rleBuf.size() * sizeof(RleData));
+				for (; idx < endY * w; idx++) {
+					size_t len = rleLen[idx];
+					auto ref = AllocRle(len);
+					std::memcpy(rleHeap.Dereference<RleData>(ref), src, len);
+					src += len / sizeof(RleData);
 
-				rle[idx] = ref;
-				rleLen[idx] = rleBuf.size() * sizeof(RleData);
+					rle[idx] = ref;
+				}
 
-				idx++;
+				std::vector<RleData>().swap(bandBufs[th]);
 			}
 
-			SPLog("RLE map created in %.6f seconds", sw.GetTime());
+			SPLog("RLE map created in %.6f seconds (%u threads)", sw.GetTime(), numBands);
 		}
 
 		SWMapRenderer::~SWMapRenderer() {}
@@ -201,18 +226,48 @@ namespace spades {
 			}
 		}
 
+		MiniHeap::Ref SWMapRenderer::AllocRle(size_t bytes) {
+			SPAssert((bytes & 3) == 0);
+			size_t sizeClass = bytes >> 2;
+			if (sizeClass < rleFreeLists.size()) {
+				auto& freeList = rleFreeLists[sizeClass];
+				if (!freeList.empty()) {
+					auto ref = freeList.back();
+					freeList.pop_back();
+					return ref;
+				}
+			}
+
+			// Blocks are never given back to `rleHeap`, so its free list stays
+			// short (only the unused tail) and this is effectively a bump
+			// allocation.
+			return rleHeap.Alloc(bytes);
+		}
+
+		void SWMapRenderer::FreeRle(MiniHeap::Ref ref, size_t bytes) {
+			SPAssert((bytes & 3) == 0);
+			size_t sizeClass = bytes >> 2;
+			if (sizeClass >= rleFreeLists.size())
+				rleFreeLists.resize(sizeClass + 1);
+			rleFreeLists[sizeClass].push_back(ref);
+		}
+
 		void SWMapRenderer::UpdateRle(int x, int y) {
 			int idx = x + y * w;
 			BuildRle(x, y, rleBuf);
 
-			rleHeap.Free(rle[idx], rleLen[idx]);
+			size_t len = rleBuf.size() * sizeof(RleData);
+			MiniHeap::Ref ref = rle[idx];
+
+			if (len != rleLen[idx]) {
+				FreeRle(ref, rleLen[idx]);
+				ref = AllocRle(len);
+			}
 
-			auto ref = rleHeap.Alloc(rleBuf.size() * sizeof(RleData));
-			short* ptr = rleHeap.Dereference<short>(ref);
-			std::memcpy(ptr, rleBuf.data(), rleBuf.size() * sizeof(RleData));
+			std::memcpy(rleHeap.Dereference<RleData>(ref), rleBuf.data(), len);
 
 			rle[idx] = ref;
-			rleLen[idx] = rleBuf.size() * sizeof(RleData);
+			rleLen[idx] = len;
 		}
 
 		template <SWFeatureLevel flevel>
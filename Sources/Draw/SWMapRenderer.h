@@ -63,10 +63,18 @@ namespace spades {
 
 			MiniHeap rleHeap;
 
+			/** Free lists of `rleHeap` blocks indexed by size class (`bytes / 4`).
+			 * RLE blocks are small and always a multiple of 4 bytes, so recycling
+			 * them by exact size keeps `UpdateRle` O(1). */
+			std::vector<std::vector<MiniHeap::Ref>> rleFreeLists;
+
 			template <SWFeatureLevel level>
 			void BuildLine(Line& line, float minPitch, float maxPitch);
 			void BuildRle(int x, int y, std::vector<RleData>&);
 
+			MiniHeap::Ref AllocRle(size_t bytes);
+			void FreeRle(MiniHeap::Ref, size_t bytes);
+
 			template <SWFeatureLevel level, int undersamp>
 			void RenderFinal(float yawMin, float yawMax, unsigned int numLines,
 			                 unsigned int threadId, unsigned int numThreads);